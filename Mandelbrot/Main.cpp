@@ -1,4 +1,5 @@
 #include "Mandelbrot.h"
+#include "RenderService.h"
 
  void write_tga(const char* name, std::uint32_t img[height][width]) // Same write function as the lab example, with very minor changes
 {
@@ -112,8 +113,20 @@ int main()
 	uint32_t fg_colour = 0x000000;
 
 	//'menu' code
-	std::cout << "Welcome! Please make your selection!:" << std::endl << "1) Generate Mandelbrot set using the lab, non-parallel example" << std::endl << "2) Generate Mandelbrot set using single parallel_for" << std::endl << "3) Generate Mandelbrot set using nested parallel_for" << std::endl ;
+	std::cout << "Welcome! Please make your selection!:" << std::endl << "1) Generate Mandelbrot set using the lab, non-parallel example" << std::endl << "2) Generate Mandelbrot set using single parallel_for" << std::endl << "3) Generate Mandelbrot set using nested parallel_for" << std::endl << "4) Run as a render service, listening for requests on a local port" << std::endl ;
 	std::cin >> func;
+	if (func == 4) // the service does not go through the rest of the menu, every request brings its own values and colours
+	{
+		int port;
+		std::cout << "Please input the port the service should listen on (e.g. 5050):" << std::endl;
+		std::cin >> port;
+		std::cout << "Please input the number of threads that should render each request (0 for one per core). Reading and sending run on separate threads, which do not count towards this:" << std::endl;
+		std::cin >> threads;
+
+		RenderService service((unsigned short)port, threads, 4); // 4 buffers are kept around, extra ones are allocated when more requests are in flight
+		service.run();
+		return 0;
+	}
 	selection += 100 * func;
 	if (func != 1)
 	{
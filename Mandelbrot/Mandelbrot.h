@@ -1,5 +1,7 @@
 #pragma once
 #include <cstdint>
+#include <cassert>
+#include <cmath>
 #include <complex>
 #include <tbb/tbb.h>
 #include <vector>
@@ -13,6 +15,13 @@
 #define width 1920
 #define iterations 500 
 
+struct MirrorPlan // which rows need computing and which can be copied from their mirror image across the real axis
+{
+	int source[height]; // row this row is copied from, or -1 if it has to be computed
+	int target[height]; // row that is copied from this one once it is done, or -1 if none
+	std::vector<int> rows; // rows that have to be computed, in order
+};
+
 // Using mandelbrot set example by Adam Sampson <a.sampson@abertay.ac.uk> as the base for this class
 class Mandelbrot
 {
@@ -40,6 +49,10 @@ public:
 	template<typename T> void generate_nested_parallel_for_func(double values[4],  T(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour); 
 	template<typename T> void generate_nested_parallel_for_func(double values[4], T(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour,int threads); 
 	
+	static MirrorPlan plan_mirror(double values[4]); // works out which rows of the viewport are mirrored, used by all the parallel functions
+	template<typename T> void complete_line(T(&img)[height][width], int i, const MirrorPlan& plan, std::mutex* image_mut = nullptr); // marks the line as done, and copies it into its mirrored row if it has one. unique_lock versions pass their array mutex
+
+	static bool generate_cancellable(double values[4], std::uint32_t(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour, tbb::task_group_context& context); // Used by the render service, returns false if the frame was cancelled before it finished. Static, since it does not use any of the arrays above.
 
 	
 
@@ -85,13 +98,103 @@ void Mandelbrot::generate_original(double values[4], uint32_t bg_colour, uint32_
 }
 
 
+// ---------- HELPER FUNCTIONS ----------
+
+MirrorPlan Mandelbrot::plan_mirror(double values[4])
+{
+	// The set is symmetric about the real axis, so if the viewport crosses it, the rows on one side are the same as the rows on the other side, just in reverse order.
+	// The side that reaches further from the axis gets computed, and every row on the other side whose mirror image is inside the viewport is copied instead.
+	// When the rows are not exactly aligned with their mirror (e.g. top 1.0, bottom -0.5), the nearest computed row is used, which is at most half a pixel off.
+	// Nearest row is used instead of blending two rows, since the image only has two colours.
+
+	MirrorPlan plan;
+	double step = (values[3] - values[2]) / height; // same formula as the imaginary part in the generation functions
+	double primary = std::abs(values[2]) >= std::abs(values[3]) ? values[2] : values[3]; // the edge that reaches further from the axis, its side gets computed
+
+	for (int y = 0; y < height; y++)
+	{
+		plan.source[y] = -1;
+		plan.target[y] = -1;
+	}
+
+	if (step != 0.0)
+	{
+		for (int y = 0; y < height; y++)
+		{
+			double im = values[2] + (y * step);
+			if (im == 0.0 || (im > 0.0) == (primary > 0.0)) // on the axis, or on the side that gets computed
+			{
+				continue;
+			}
+
+			long s = std::lround((-im - values[2]) / step); // row closest to the mirror image of this one
+			if (s < 0 || s >= height || s == y) // a row less than a quarter pixel from the axis can round to itself, it has to be computed
+			{
+				continue;
+			}
+
+			double im_s = values[2] + (s * step);
+			bool s_computed = im_s == 0.0 || (im_s > 0.0) == (primary > 0.0); // only rows on the computed side can be copied from, any other row might never be generated
+			if (s_computed && plan.source[s] == -1 && plan.target[s] == -1)
+			{
+				plan.source[y] = (int)s;
+				plan.target[s] = y;
+			}
+		}
+	}
+
+	for (int y = 0; y < height; y++)
+	{
+		if (plan.source[y] == -1)
+		{
+			plan.rows.push_back(y);
+		}
+		else
+		{
+			assert(plan.source[plan.source[y]] == -1 && plan.target[plan.source[y]] == y); // every copied row must come from a row that is computed, or the file-writing thread would wait for it forever
+		}
+	}
+
+	return plan;
+}
+
+template<typename T> void Mandelbrot::complete_line(T(&img)[height][width], int i, const MirrorPlan& plan, std::mutex* image_mut)
+{
+	// called while the generating thread still holds line_mutex[i]
+	Mandelbrot::line_completed[i] = true;
+	Mandelbrot::write_condition[i].notify_one();
+
+	int t = plan.target[i];
+	if (t != -1) // copy the line into its mirror straight away, so the file-writing thread does not have to wait for it any longer than for this one
+	{
+		std::lock_guard<std::mutex> lg(line_mutex[t]);
+		for (int x = 0; x < width; x++) // the casts let the same lines work for the atomic array too
+		{
+			if (image_mut) // the unique_lock versions lock the array for every pixel they write, so the copied pixels have to go through the same mutex for the timings to be comparable
+			{
+				std::unique_lock<std::mutex> lock(*image_mut);
+				img[t][x] = static_cast<std::uint32_t>(img[i][x]);
+			}
+			else
+			{
+				img[t][x] = static_cast<std::uint32_t>(img[i][x]);
+			}
+		}
+		Mandelbrot::line_completed[t] = true;
+		Mandelbrot::write_condition[t].notify_one();
+	}
+}
+
+
 // ---------- PARALLEL FUNCTIONS -----------
 
 template<> void Mandelbrot::generate_parallel_for(double values[4], std::uint32_t(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour) // generates the set with TBB's parallel_for using unique-lock for safe sharing of the array, with no manual thread  limit
 {
+	MirrorPlan plan = plan_mirror(values);
 
 	std::mutex image_mut; // mutex for sharing the array
-	tbb::parallel_for(0, height, [&](int i) { // a for loop, but parallel, form TBB
+	tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) { // a for loop, but parallel, form TBB
+		int i = plan.rows[r];
 
 		std::lock_guard<std::mutex> lg(line_mutex[i]); // obtain the mutex that is checked by the file-wriing thread
 		for (int x = 0; x < width; x++) // non-parallel for loop, each task will generate an entire row.
@@ -121,8 +224,7 @@ template<> void Mandelbrot::generate_parallel_for(double values[4], std::uint32_
 			}
 		}
 		
-		Mandelbrot::line_completed[i] = true; //set the bool array that file-writing thread will consult
-		Mandelbrot::write_condition[i].notify_one(); //notify the file-writing thread that a line has been completed (potentially the line that the thread is waiting for
+		complete_line(img, i, plan, &image_mut); //set the bool array that file-writing thread will consult, notify it, and do the same for the mirrored line if there is one
 		});
 
 
@@ -131,9 +233,11 @@ template<> void Mandelbrot::generate_parallel_for(double values[4], std::uint32_
 
 template<> void Mandelbrot::generate_parallel_for<std::atomic<std::uint32_t>> (double values[4], std::atomic<std::uint32_t>(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour) //generate the set with TBB's parallel_for, using a atomic array and with no manual thread limit
 {
+	MirrorPlan plan = plan_mirror(values);
 	// this, and some other specialisations of functions do not have the array sharing mutex, since they use the atomic version of the array, with which the mutex is not needed
 	
-	tbb::parallel_for(0, height, [&](int i) {
+	tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) {
+		int i = plan.rows[r];
 
 		std::lock_guard<std::mutex> lg(line_mutex[i]);
 		for (int x = 0; x < width; x++)
@@ -161,8 +265,7 @@ template<> void Mandelbrot::generate_parallel_for<std::atomic<std::uint32_t>> (d
 			}
 		}
 		
-		Mandelbrot::line_completed[i] = true;
-		Mandelbrot::write_condition[i].notify_one();
+		complete_line(img, i, plan);
 		});
 
 
@@ -171,11 +274,13 @@ template<> void Mandelbrot::generate_parallel_for<std::atomic<std::uint32_t>> (d
 
 template<> void Mandelbrot::generate_parallel_for<std::uint32_t>(double values[4], std::uint32_t(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour, int threads)
 {
+	MirrorPlan plan = plan_mirror(values);
 
 	std::mutex image_mut; 
 	tbb::task_arena thread_limit(threads); 
 	thread_limit.execute([&] {
-		tbb::parallel_for(0, height, [&](int i) { 
+		tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) { 
+			int i = plan.rows[r];
 
 			std::lock_guard<std::mutex> lg(line_mutex[i]);
 			for (int x = 0; x < width; x++)
@@ -205,8 +310,7 @@ template<> void Mandelbrot::generate_parallel_for<std::uint32_t>(double values[4
 				}
 			}
 			
-			Mandelbrot::line_completed[i] = true;
-			Mandelbrot::write_condition[i].notify_one();
+			complete_line(img, i, plan, &image_mut);
 			});
 		});
 
@@ -215,11 +319,13 @@ template<> void Mandelbrot::generate_parallel_for<std::uint32_t>(double values[4
 
 template<> void Mandelbrot::generate_parallel_for<std::atomic<std::uint32_t>>(double values[4], std::atomic<std::uint32_t>(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour, int threads)
 {
+	MirrorPlan plan = plan_mirror(values);
 
 	
 	tbb::task_arena thread_limit(threads); // Task arena which is needed by TBB to limit the amount of threads that will run
 	thread_limit.execute([&] { // Running the generation code inside a lambda expression in the 'thread_limit' task arena, to limit the thread number to the 'threads' value
-		tbb::parallel_for(0, height, [&](int i) { // Parallel for from TBB will run a separate thread for each 'i' value, however starting no more threads than the limit that was imposed by task arena.
+		tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) { // Parallel for from TBB will run a separate thread for each 'i' value, however starting no more threads than the limit that was imposed by task arena.
+			int i = plan.rows[r];
 
 			std::lock_guard<std::mutex> lg(line_mutex[i]);
 			for (int x = 0; x < width; x++)
@@ -249,8 +355,7 @@ template<> void Mandelbrot::generate_parallel_for<std::atomic<std::uint32_t>>(do
 				}
 			}
 			// here insert the thingy
-			Mandelbrot::line_completed[i] = true;
-			Mandelbrot::write_condition[i].notify_one();
+			complete_line(img, i, plan);
 			});
 		});
 
@@ -259,9 +364,11 @@ template<> void Mandelbrot::generate_parallel_for<std::atomic<std::uint32_t>>(do
 
 template<> void Mandelbrot::generate_nested_parallel_for<std::uint32_t>(double values[4], std::uint32_t(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour)
 {
+	MirrorPlan plan = plan_mirror(values);
 
 	std::mutex image_mut;
-	tbb::parallel_for(0, height, [&](int i) {
+	tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) {
+		int i = plan.rows[r];
 
 		std::lock_guard<std::mutex> lg(line_mutex[i]);
 		tbb::parallel_for(0, width, [&](int j) {
@@ -290,8 +397,7 @@ template<> void Mandelbrot::generate_nested_parallel_for<std::uint32_t>(double v
 
 			}
 			});
-		Mandelbrot::line_completed[i] = true;
-		Mandelbrot::write_condition[i].notify_one();
+		complete_line(img, i, plan, &image_mut);
 		});
 
 
@@ -300,9 +406,11 @@ template<> void Mandelbrot::generate_nested_parallel_for<std::uint32_t>(double v
 
 template<> void Mandelbrot::generate_nested_parallel_for<std::atomic<std::uint32_t>>(double values[4], std::atomic<std::uint32_t>(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour)
 {
+	MirrorPlan plan = plan_mirror(values);
 
 	
-	tbb::parallel_for(0, height, [&](int i) {
+	tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) {
+		int i = plan.rows[r];
 
 		std::lock_guard<std::mutex> lg(line_mutex[i]);
 		tbb::parallel_for(0, width, [&](int j) {
@@ -331,8 +439,7 @@ template<> void Mandelbrot::generate_nested_parallel_for<std::atomic<std::uint32
 
 			}
 			});
-		Mandelbrot::line_completed[i] = true;
-		Mandelbrot::write_condition[i].notify_one();
+		complete_line(img, i, plan);
 		});
 
 
@@ -341,11 +448,13 @@ template<> void Mandelbrot::generate_nested_parallel_for<std::atomic<std::uint32
 
 template<> void Mandelbrot::generate_nested_parallel_for<std::uint32_t>(double values[4], std::uint32_t(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour, int threads)
 {
+	MirrorPlan plan = plan_mirror(values);
 
 	std::mutex image_mut;
 	tbb::task_arena thread_limit(threads);
 	thread_limit.execute([&] {
-		tbb::parallel_for(0, height, [&](int i) {
+		tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) {
+			int i = plan.rows[r];
 			std::lock_guard<std::mutex> lg(line_mutex[i]);
 			tbb::parallel_for(0, width, [&](int j) {
 
@@ -373,8 +482,7 @@ template<> void Mandelbrot::generate_nested_parallel_for<std::uint32_t>(double v
 
 				}
 				});
-			Mandelbrot::line_completed[i] = true;
-			Mandelbrot::write_condition[i].notify_one();
+			complete_line(img, i, plan, &image_mut);
 			});
 		});
 
@@ -385,11 +493,13 @@ template<> void Mandelbrot::generate_nested_parallel_for<std::uint32_t>(double v
 
 template<> void Mandelbrot::generate_nested_parallel_for<std::atomic<std::uint32_t>>(double values[4], std::atomic<std::uint32_t>(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour, int threads)
 {
+	MirrorPlan plan = plan_mirror(values);
 
 	
 	tbb::task_arena thread_limit(threads);
 	thread_limit.execute([&] {
-		tbb::parallel_for(0, height, [&](int i) {
+		tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) {
+			int i = plan.rows[r];
 			std::lock_guard<std::mutex> lg(line_mutex[i]);
 			tbb::parallel_for(0, width, [&](int j) {
 
@@ -417,8 +527,7 @@ template<> void Mandelbrot::generate_nested_parallel_for<std::atomic<std::uint32
 
 				}
 				});
-			Mandelbrot::line_completed[i] = true;
-			Mandelbrot::write_condition[i].notify_one();
+			complete_line(img, i, plan);
 			});
 		});
 
@@ -426,3 +535,49 @@ template<> void Mandelbrot::generate_nested_parallel_for<std::atomic<std::uint32
 
 
 }
+
+
+// ---------- CANCELLABLE FUNCTIONS ----------
+
+bool Mandelbrot::generate_cancellable(double values[4], std::uint32_t(&img)[height][width], uint32_t bg_colour, uint32_t fg_colour, tbb::task_group_context& context)
+{
+	// Same as the atomic parallel_for, but run under the context passed in, so that the caller can stop it with context.cancel_group_execution().
+	// TBB stops handing out new rows once the context is cancelled, so at most the rows that are already being computed will still finish.
+	// No line mutexes or write notifications here, the render service only sends whole frames, and the buffer belongs to a single job.
+
+	MirrorPlan plan = plan_mirror(values);
+	tbb::parallel_for(0, (int)plan.rows.size(), [&](int r) {
+		int i = plan.rows[r];
+
+		for (int x = 0; x < width; x++)
+		{
+
+			std::complex<double> c(values[0] + (x * (values[1] - values[0]) / width), values[2] + (i * (values[3] - values[2]) / height));
+			std::complex<double> z(0.0, 0.0);
+			int it = 0;
+
+			while (abs(z) < 2.0 && it < iterations)
+			{
+				z = (z * z) + c;
+
+				++it;
+			}
+
+			if (it == iterations)
+			{
+				img[i][x] = fg_colour;
+			}
+			else
+			{
+				img[i][x] = bg_colour;
+			}
+		}
+
+		if (plan.target[i] != -1)
+		{
+			std::copy(img[i], img[i] + width, img[plan.target[i]]);
+		}
+		}, context);
+
+	return !context.is_group_execution_cancelled();
+}
@@ -0,0 +1,524 @@
+#pragma once
+#include "Mandelbrot.h"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX // otherwise windows.h (pulled in by winsock2.h) defines min and max as macros, which breaks std::min
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+typedef SOCKET socket_t;
+#define close_socket closesocket
+#define SEND_FLAGS 0
+#define SHUTDOWN_BOTH SD_BOTH
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define close_socket close
+#define SEND_FLAGS MSG_NOSIGNAL // a client going away should not kill the whole service with SIGPIPE
+#define SHUTDOWN_BOTH SHUT_RDWR
+#endif
+
+
+// Resident render service. Instead of going through the menu for every image, the program stays running and listens on a local (127.0.0.1) TCP port.
+// Clients send one request per line:
+//     <id> <left> <right> <top> <bottom> <bg_colour> <fg_colour>
+// and get exactly one reply per request, tagged with the same id:
+//     OK <id> <bytes>\n followed by <bytes> of a .tga file
+//     CANCELLED <id>\n if a newer request from the same connection replaced it before it finished, or a newer frame was ready before this one could be sent
+//     ERROR <id>\n if the line could not be parsed
+// A new request on a connection supersedes the previous one (the user panned again), and identical requests that are in flight at the same time only get rendered once.
+
+struct Frame // one image worth of pixels, kept in a pool so they do not need to be allocated for every request
+{
+	std::uint32_t pixels[height][width];
+};
+
+class RenderService
+{
+
+public:
+
+	RenderService(unsigned short port, int threads, int pool_size);
+	~RenderService();
+
+	void run(); // accept connections forever, every connection gets its own thread
+
+private:
+
+	typedef std::tuple<double, double, double, double, uint32_t, uint32_t> Key; // everything that changes what the image looks like, used to coalesce identical requests
+
+	struct Connection;
+
+	struct Job
+	{
+		Key key;
+		double values[4];
+		uint32_t bg_colour, fg_colour;
+		std::unique_ptr<Frame> frame;
+		tbb::task_group_context context; // lets us stop the parallel_for when nobody wants this frame anymore
+		std::vector<std::pair<std::shared_ptr<Connection>, long long>> subscribers; // who gets the result, and under what request id
+	};
+
+	struct Result // a finished frame, shared by everyone who asked for it. The sender threads write it out as .tga straight from the pixels, a row at a time
+	{
+		RenderService* service;
+		std::unique_ptr<Frame> frame;
+
+		~Result() { service->release(std::move(frame)); } // everyone has been sent it (or has gone away), so the buffer can go back to the pool
+	};
+
+	struct Connection
+	{
+		struct Message
+		{
+			std::string line;
+			long long id;
+			std::shared_ptr<Result> result; // null if the reply is just the line
+		};
+
+		socket_t sock;
+		std::shared_ptr<Job> current; // last job this connection asked for, cancelled when a newer request comes in
+		long long current_id = 0;
+
+		std::mutex outbox_mutex; // protects outbox and closed
+		std::condition_variable outbox_ready;
+		std::deque<Message> outbox;
+		bool closed = false;
+		std::thread sender; // the only thread writing to the socket, so a client that stops reading only blocks its own sender, not the arena or other clients
+
+		Connection(socket_t s) : sock(s) {}
+		~Connection() { close_socket(sock); }
+		void post(const std::string& line, long long id = 0, std::shared_ptr<Result> result = nullptr); // queue a reply, never waits for the socket
+		void send_loop();
+		bool send_all(const char* data, size_t length);
+		bool send_frame(const Frame& frame);
+		void stop(); // called by serve when the client disconnects, stops the sender thread
+	};
+
+	static const size_t tga_size = 18 + (size_t)height * width * 3;
+	static const size_t max_outbox = 64; // a client with this many replies waiting is not reading them, so it gets disconnected
+
+	socket_t listener;
+	tbb::task_arena arena; // kept alive between requests, so its worker threads do not have to be created again for every request
+	int pool_size;
+
+	std::mutex service_mutex; // protects everything below
+	std::vector<std::unique_ptr<Frame>> pool;
+	std::map<Key, std::shared_ptr<Job>> in_flight;
+
+	void serve(std::shared_ptr<Connection> conn);
+	void submit(const std::shared_ptr<Connection>& conn, long long id, double values[4], uint32_t bg_colour, uint32_t fg_colour);
+	bool drop_current(const std::shared_ptr<Connection>& conn, long long& dropped_id); // must be called with service_mutex locked, returns true if the caller should send CANCELLED for dropped_id
+	void render(std::shared_ptr<Job> job);
+	void release(std::unique_ptr<Frame> frame); // give a buffer back to the pool, if there is space for it
+
+};
+
+
+RenderService::RenderService(unsigned short port, int threads, int pool_size) : pool_size(pool_size)
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+
+	// No slot is reserved for a master thread (the 0), since renders are enqueued and the main thread never joins them, it just sits in accept().
+	// With the default of one reserved slot, every render would get one thread less than asked for.
+	if (threads > 0)
+	{
+		arena.initialize(threads, 0);
+	}
+	else
+	{
+		arena.initialize(tbb::task_arena::automatic, 0); // no limit, one thread per core
+	}
+	arena.execute([&] { // run one short task per thread, so TBB creates its worker threads now instead of during the first request
+		tbb::parallel_for(0, arena.max_concurrency(), [](int) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10)); // long enough that the tasks cannot all be finished by the first thread
+			});
+		});
+	// TBB can put idle workers to sleep again later, but waking one up is much cheaper than creating it
+
+	for (int i = 0; i < pool_size; i++)
+	{
+		pool.push_back(std::unique_ptr<Frame>(new Frame));
+	}
+
+	listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listener == INVALID_SOCKET)
+	{
+		std::cout << "Could not create the listening socket" << std::endl;
+		exit(1);
+	}
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local only, this is not meant to be reachable from other machines
+	address.sin_port = htons(port);
+	int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+	{
+		std::cout << "Could not listen on port " << port << std::endl;
+		exit(1);
+	}
+}
+
+RenderService::~RenderService()
+{
+	close_socket(listener);
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+void RenderService::run()
+{
+	std::cout << "Render service is running, waiting for requests..." << std::endl;
+	while (true)
+	{
+		socket_t client = accept(listener, nullptr, nullptr);
+		if (client == INVALID_SOCKET)
+		{
+			continue;
+		}
+		std::thread(&RenderService::serve, this, std::make_shared<Connection>(client)).detach(); // the connection thread only reads requests, rendering happens in the arena
+	}
+}
+
+void RenderService::Connection::post(const std::string& line, long long id, std::shared_ptr<Result> result)
+{
+	std::lock_guard<std::mutex> lg(outbox_mutex);
+	if (closed) // client is gone, nobody to send it to
+	{
+		return;
+	}
+
+	if (result) // a newer frame makes any frame still queued for this client stale, so those are answered with CANCELLED and their buffers are let go now
+	{
+		for (auto& queued : outbox)
+		{
+			if (queued.result)
+			{
+				queued.line = "CANCELLED " + std::to_string(queued.id) + "\n";
+				queued.result.reset();
+			}
+		}
+	}
+
+	if (outbox.size() >= max_outbox) // the client has stopped reading, give up on it instead of queueing forever
+	{
+		closed = true;
+		outbox.clear();
+		outbox_ready.notify_one();
+		shutdown(sock, SHUTDOWN_BOTH); // also makes recv() in serve return, which cleans up the rest
+		return;
+	}
+
+	outbox.push_back(Message{ line, id, result });
+	outbox_ready.notify_one();
+}
+
+void RenderService::Connection::send_loop()
+{
+	while (true)
+	{
+		Message message;
+		{
+			std::unique_lock<std::mutex> ul(outbox_mutex);
+			outbox_ready.wait(ul, [&] { return closed || !outbox.empty(); });
+			if (closed)
+			{
+				return;
+			}
+			message = std::move(outbox.front());
+			outbox.pop_front();
+		}
+
+		if (send_all(message.line.c_str(), message.line.size()) && message.result)
+		{
+			send_frame(*message.result->frame);
+		}
+	}
+}
+
+bool RenderService::Connection::send_all(const char* data, size_t length)
+{
+	while (length > 0)
+	{
+		int sent = send(sock, data, (int)(std::min)(length, (size_t)1 << 20), SEND_FLAGS);
+		if (sent <= 0) // client went away, nothing more we can do for it
+		{
+			return false;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+void RenderService::Connection::stop()
+{
+	{
+		std::lock_guard<std::mutex> lg(outbox_mutex);
+		closed = true;
+	}
+	outbox_ready.notify_one();
+	shutdown(sock, SHUTDOWN_BOTH); // wakes the sender up if it is stuck in send() to a client that stopped reading
+	sender.join();
+
+	// frames still waiting to be sent go back to the pool here, and not later from whoever drops the last reference to this connection, which could be holding service_mutex
+	std::lock_guard<std::mutex> lg(outbox_mutex);
+	outbox.clear();
+}
+
+bool RenderService::Connection::send_frame(const Frame& frame)
+{
+	// Same format as write_tga, but converted one row at a time, so no copy of the whole image is needed
+	uint8_t header[18] = {
+		0, // no image ID
+		0, // no colour map
+		2, // uncompressed 24-bit image
+		0, 0, 0, 0, 0, // empty colour map specification
+		0, 0, // X origin
+		0, 0, // Y origin
+		width & 0xFF, (width >> 8) & 0xFF, // width
+		height & 0xFF, (height >> 8) & 0xFF, // height
+		24, // bits per pixel
+		0, // image descriptor
+	};
+	if (!send_all((const char*)header, 18))
+	{
+		return false;
+	}
+
+	char row[width * 3];
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			std::uint32_t pixel = frame.pixels[y][x];
+			row[x * 3] = (char)(pixel & 0xFF); // blue channel
+			row[x * 3 + 1] = (char)((pixel >> 8) & 0xFF); // green channel
+			row[x * 3 + 2] = (char)((pixel >> 16) & 0xFF); // red channel
+		}
+		if (!send_all(row, sizeof(row)))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void RenderService::serve(std::shared_ptr<Connection> conn)
+{
+	std::string buffer;
+	char chunk[1024];
+	int received;
+
+	conn->sender = std::thread(&Connection::send_loop, conn.get());
+
+	while ((received = recv(conn->sock, chunk, sizeof(chunk), 0)) > 0)
+	{
+		buffer.append(chunk, received);
+		size_t end;
+		while ((end = buffer.find('\n')) != std::string::npos) // handle every complete line we have so far
+		{
+			std::istringstream line(buffer.substr(0, end));
+			buffer.erase(0, end + 1);
+
+			long long id = 0;
+			double values[4];
+			uint32_t bg_colour, fg_colour;
+			if (line >> id >> values[0] >> values[1] >> values[2] >> values[3] >> std::hex >> bg_colour >> fg_colour)
+			{
+				submit(conn, id, values, bg_colour, fg_colour);
+			}
+			else
+			{
+				conn->post("ERROR " + std::to_string(id) + "\n");
+			}
+		}
+	}
+
+	// connection closed, whatever it was waiting for is not needed anymore
+	{
+		std::lock_guard<std::mutex> lg(service_mutex);
+		long long dropped_id;
+		drop_current(conn, dropped_id);
+	}
+	conn->stop();
+}
+
+void RenderService::submit(const std::shared_ptr<Connection>& conn, long long id, double values[4], uint32_t bg_colour, uint32_t fg_colour)
+{
+	Key key(values[0], values[1], values[2], values[3], bg_colour, fg_colour);
+	std::shared_ptr<Job> job;
+	bool start = false;
+	bool dropped = false;
+	long long dropped_id = 0;
+	{
+		std::lock_guard<std::mutex> lg(service_mutex);
+		if (conn->current && conn->current->key == key) // same frame asked for again, keep rendering it and answer under the new id instead
+		{
+			for (auto& sub : conn->current->subscribers)
+			{
+				if (sub.first == conn && sub.second == conn->current_id)
+				{
+					sub.second = id;
+				}
+			}
+			dropped = true;
+			dropped_id = conn->current_id;
+			conn->current_id = id;
+		}
+		else
+		{
+			dropped = drop_current(conn, dropped_id); // the user moved on, the previous frame is stale
+
+			auto found = in_flight.find(key);
+			if (found != in_flight.end()) // someone already asked for exactly this frame, just wait for the same result
+			{
+				job = found->second;
+			}
+			else
+			{
+				job = std::make_shared<Job>();
+				job->key = key;
+				std::copy(values, values + 4, job->values);
+				job->bg_colour = bg_colour;
+				job->fg_colour = fg_colour;
+				if (!pool.empty())
+				{
+					job->frame = std::move(pool.back());
+					pool.pop_back();
+				}
+				else
+				{
+					job->frame.reset(new Frame); // more jobs than buffers, the extra one will go back into the pool if there is space
+				}
+				in_flight[key] = job;
+				start = true;
+			}
+			job->subscribers.push_back(std::make_pair(conn, id));
+			conn->current = job;
+			conn->current_id = id;
+		}
+	}
+
+	if (dropped)
+	{
+		conn->post("CANCELLED " + std::to_string(dropped_id) + "\n");
+	}
+
+	if (start)
+	{
+		arena.enqueue([this, job] { render(job); });
+	}
+}
+
+bool RenderService::drop_current(const std::shared_ptr<Connection>& conn, long long& dropped_id)
+{
+	std::shared_ptr<Job> job = conn->current;
+	bool dropped = false;
+	if (!job)
+	{
+		return false;
+	}
+	conn->current.reset();
+	dropped_id = conn->current_id;
+
+	auto& subs = job->subscribers;
+	for (auto it = subs.begin(); it != subs.end(); ++it)
+	{
+		if (it->first == conn && it->second == conn->current_id)
+		{
+			subs.erase(it);
+			dropped = true;
+			break;
+		}
+	}
+	// if the subscriber was not found, the job has already finished and sent its result
+
+	if (subs.empty()) // nobody else is waiting for this frame either, so stop computing it
+	{
+		job->context.cancel_group_execution();
+		auto found = in_flight.find(job->key);
+		if (found != in_flight.end() && found->second == job) // a new identical request should start a fresh job, not join the cancelled one
+		{
+			in_flight.erase(found);
+		}
+	}
+	return dropped;
+}
+
+void RenderService::render(std::shared_ptr<Job> job)
+{
+	bool finished = Mandelbrot::generate_cancellable(job->values, job->frame->pixels, job->bg_colour, job->fg_colour, job->context);
+
+	std::vector<std::pair<std::shared_ptr<Connection>, long long>> subscribers;
+	{
+		std::lock_guard<std::mutex> lg(service_mutex);
+		auto found = in_flight.find(job->key);
+		if (found != in_flight.end() && found->second == job)
+		{
+			in_flight.erase(found);
+		}
+		subscribers.swap(job->subscribers); // after this, drop_current will not find them and will not send CANCELLED
+		for (auto& sub : subscribers)
+		{
+			if (sub.first->current == job)
+			{
+				sub.first->current.reset();
+			}
+		}
+	}
+
+	if (finished && !subscribers.empty())
+	{
+		// only hand the frame over here, converting and sending happen on the connections' sender threads, so a slow client cannot hold up an arena worker
+		std::shared_ptr<Result> result = std::make_shared<Result>();
+		result->service = this;
+		result->frame = std::move(job->frame);
+		for (auto& sub : subscribers)
+		{
+			sub.first->post("OK " + std::to_string(sub.second) + " " + std::to_string(tga_size) + "\n", sub.second, result);
+		}
+	}
+	else
+	{
+		release(std::move(job->frame));
+	}
+}
+
+void RenderService::release(std::unique_ptr<Frame> frame)
+{
+	if (!frame)
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lg(service_mutex);
+	if ((int)pool.size() < pool_size) // keep the buffer, so the next request does not have to allocate
+	{
+		pool.push_back(std::move(frame));
+	}
+}